@@ -0,0 +1,110 @@
+/* usdt.h: Fire usdt probes from compiled code.
+ *
+ * Add usdt to the LinkingTo and Imports fields of your package's DESCRIPTION
+ * file, and then:
+ *
+ *   #include <usdt.h>
+ *
+ *   // On the main R thread, from the ptr() of a handle returned by
+ *   // Provider$add_probe():
+ *   usdt_probe_t *probe = usdt_probe(ptr);
+ *
+ *   // From any thread, for as long as the handle is kept alive:
+ *   if (USDT_PROBE_ENABLED(probe)) {
+ *     uint64_t args[] = {(uint64_t) chunk, usdt_double_arg(elapsed)};
+ *     usdt_probe_fire(probe, args);
+ *   }
+ *
+ * Arguments are passed as they are from R: 32-bit integers, 64-bit integers,
+ * doubles bit-for-bit (see usdt_double_arg()), and strings as pointers. The
+ * array passed to usdt_probe_fire() must hold as many arguments as the probe
+ * accepts.
+ *
+ * Do not disable the provider, or stop its flight recorder, while other
+ * threads may be firing its probes.
+ */
+
+#ifndef USDT_H
+#define USDT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The first fields of libstapsdt's SDTProbe_t (which usdt checks at compile
+ * time). Treat as opaque. */
+typedef struct usdt_probe_t {
+  unsigned short *semaphore;
+  void *recorder;
+} usdt_probe_t;
+
+/* True if a tracer is listening to the probe (or the provider's flight
+ * recorder is running). Reads the probe's semaphore directly, so this is
+ * cheap enough to guard the innermost loops. */
+#define USDT_PROBE_ENABLED(probe)                                           \
+  ((probe)->recorder != NULL ||                                             \
+   ((probe)->semaphore != NULL &&                                           \
+    *(volatile unsigned short *) (probe)->semaphore > 0))
+
+static inline uint64_t usdt_double_arg(double value)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(double));
+  return bits;
+}
+
+static inline uint64_t usdt_string_arg(const char *value)
+{
+  return (uint64_t) (uintptr_t) value;
+}
+
+/* Function pointers are resolved on first use, which must be on the main R
+ * thread; usdt_probe() resolves all of them. */
+static usdt_probe_t *(*usdt__probe)(SEXP) = NULL;
+static int (*usdt__probe_enabled)(usdt_probe_t *) = NULL;
+static void (*usdt__probe_fire)(usdt_probe_t *, const uint64_t *) = NULL;
+
+static inline void usdt__init(void)
+{
+  if (usdt__probe == NULL) {
+    usdt__probe = (usdt_probe_t *(*)(SEXP)) R_GetCCallable("usdt", "probe");
+    usdt__probe_enabled = (int (*)(usdt_probe_t *))
+      R_GetCCallable("usdt", "probe_enabled");
+    usdt__probe_fire = (void (*)(usdt_probe_t *, const uint64_t *))
+      R_GetCCallable("usdt", "probe_fire");
+  }
+}
+
+/* Returns the probe behind the external pointer from the ptr() method of a
+ * handle returned by Provider$add_probe(). Signals an R error for anything
+ * else, so only call this on the main R thread. */
+static inline usdt_probe_t *usdt_probe(SEXP ptr)
+{
+  usdt__init();
+  return usdt__probe(ptr);
+}
+
+/* A function call equivalent of USDT_PROBE_ENABLED(). */
+static inline int usdt_probe_enabled(usdt_probe_t *probe)
+{
+  usdt__init();
+  return usdt__probe_enabled(probe);
+}
+
+/* Fires the probe. Safe to call from any thread. */
+static inline void usdt_probe_fire(usdt_probe_t *probe, const uint64_t *args)
+{
+  usdt__init();
+  usdt__probe_fire(probe, args);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* USDT_H */
@@ -1,7 +1,12 @@
+#include <stddef.h> /* for offsetof */
 #include <stdlib.h> /* for malloc */
 #include <stdint.h> /* for uint64_t */
+#include <string.h> /* for memcpy */
+#include <time.h> /* for clock_gettime */
 #include <Rinternals.h>
 #include "libstapsdt.h"
+#include "recorder.h"
+#include "usdt.h" /* For testing the C API against the real layout. */
 
 struct provider {
   SDTProvider_t *provider;
@@ -21,7 +26,7 @@ static void R_finalize_provider(SEXP ptr)
   R_ClearExternalPtr(ptr);
 }
 
-SEXP R_usdt_provider(SEXP name)
+SEXP R_usdt_provider(SEXP name, SEXP in_memory, SEXP tmpdir)
 {
   const char *name_str = CHAR(Rf_asChar(name));
   struct provider *p = malloc(sizeof(struct provider));
@@ -30,6 +35,12 @@ SEXP R_usdt_provider(SEXP name)
   if (!p->provider) {
     Rf_error("Failed to create USDT provider.\n");
   }
+  if (Rf_asLogical(in_memory) == TRUE) {
+    providerSetLoadMode(p->provider, loadModeMemfd);
+  }
+  if (tmpdir != R_NilValue) {
+    providerSetTmpDir(p->provider, CHAR(Rf_asChar(tmpdir)));
+  }
 
   SEXP ptr = PROTECT(R_MakeExternalPtr(p, R_NilValue, R_NilValue));
   R_RegisterCFinalizerEx(ptr, R_finalize_provider, 1);
@@ -46,6 +57,16 @@ SEXP R_usdt_provider_is_enabled(SEXP ptr)
   return Rf_ScalarLogical(p->loaded);
 }
 
+/* In-memory libraries fall back to temporary files (e.g. on kernels with
+ * vm.memfd_noexec=2), which tracers find differently, so say why. */
+static void usdt_warn_memfd_fallback(struct provider *p)
+{
+  if (p->provider->memfdError) {
+    Rf_warning("Loaded USDT provider '%s' from a temporary file instead: %s.",
+               p->provider->name, p->provider->memfdError);
+  }
+}
+
 SEXP R_usdt_provider_enable(SEXP ptr)
 {
   struct provider *p = (struct provider *) R_ExternalPtrAddr(ptr);
@@ -60,6 +81,7 @@ SEXP R_usdt_provider_enable(SEXP ptr)
     Rf_error("Failed to enable USDT provider: %s.\n", p->provider->error);
   }
   p->loaded = 1;
+  usdt_warn_memfd_fallback(p);
 
   return R_NilValue;
 }
@@ -82,17 +104,51 @@ SEXP R_usdt_provider_disable(SEXP ptr)
   return R_NilValue;
 }
 
-ArgType_t usdt_argtype_from_sexp(SEXP arg)
+/* The paths of the provider's shared libraries, oldest first. */
+SEXP R_usdt_provider_paths(SEXP ptr)
+{
+  struct provider *p = (struct provider *) R_ExternalPtrAddr(ptr);
+  if (!p) {
+    Rf_error("Invalid USDT provider.\n");
+  }
+  R_xlen_t n = 0;
+  for (SDTShard_t *shard = p->provider->_shards; shard; shard = shard->next) {
+    n++;
+  }
+  SEXP out = PROTECT(Rf_allocVector(STRSXP, n));
+  for (SDTShard_t *shard = p->provider->_shards; shard; shard = shard->next) {
+    SET_STRING_ELT(out, --n, Rf_mkChar(shard->_filename));
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+static int usdt_is_integer64(SEXP arg)
+{
+  return TYPEOF(arg) == REALSXP && Rf_inherits(arg, "integer64");
+}
+
+/* Raw vectors are passed as a pointer and a length, so they take up two of the
+ * probe's arguments. Returns the number of arguments used. */
+int usdt_argtypes_from_sexp(SEXP arg, ArgType_t *types)
 {
   switch(TYPEOF(arg)) {
   case LGLSXP:
     /* fallthrough */
   case INTSXP:
-    return int32;
-  case STRSXP:
-    /* fallthrough */
+    types[0] = int32;
+    return 1;
   case REALSXP:
-    return uint64;
+    /* bit64's integer64 vectors are doubles holding the int64 bits. */
+    types[0] = usdt_is_integer64(arg) ? int64 : float64;
+    return 1;
+  case STRSXP:
+    types[0] = uint64;
+    return 1;
+  case RAWSXP:
+    types[0] = uint64;
+    types[1] = int64;
+    return 2;
   default:
     Rf_error("Can't pass R '%s' objects to a probe.", Rf_type2char(TYPEOF(arg)));
   }
@@ -108,101 +164,232 @@ SEXP R_usdt_add_probe(SEXP args)
   if (!p) {
     Rf_error("Invalid USDT provider.\n");
   }
-  if (p->loaded) {
-    Rf_error("Probes cannot be added while the provider is loaded.\n");
-  }
   args = CDDR(args);
-  int arg_count = Rf_length(args);
-  if (arg_count > 6) {
+  ArgType_t types[MAX_ARGUMENTS + 1] = {noarg};
+  int arg_count = 0;
+  unsigned int string_args = 0;
+  for (; args != R_NilValue; args = CDR(args)) {
+    if (arg_count >= MAX_ARGUMENTS) {
+      Rf_error("Probes cannot accept more than 6 arguments at present.");
+    }
+    if (TYPEOF(CAR(args)) == STRSXP) {
+      string_args |= 1U << arg_count;
+    }
+    arg_count += usdt_argtypes_from_sexp(CAR(args), &types[arg_count]);
+  }
+  if (arg_count > MAX_ARGUMENTS) {
     Rf_error("Probes cannot accept more than 6 arguments at present.");
   }
-  SDTProbe_t *probe;
-  SEXP first;
 
-  switch (arg_count) {
-  case 1:
-    probe = providerAddProbe(p->provider, name_str, 1,
-                             usdt_argtype_from_sexp(CAR(args)));
-    break;
-  case 2:
-    probe = providerAddProbe(p->provider, name_str, 2,
-                             usdt_argtype_from_sexp(CAR(args)),
-                             usdt_argtype_from_sexp(CADR(args)));
-    break;
-  case 3:
-    probe = providerAddProbe(p->provider, name_str, 3,
-                             usdt_argtype_from_sexp(CAR(args)),
-                             usdt_argtype_from_sexp(CADR(args)),
-                             usdt_argtype_from_sexp(CADDR(args)));
-    break;
-  case 4:
-    probe = providerAddProbe(p->provider, name_str, 4,
-                             usdt_argtype_from_sexp(CAR(args)),
-                             usdt_argtype_from_sexp(CADR(args)),
-                             usdt_argtype_from_sexp(CADDR(args)),
-                             usdt_argtype_from_sexp(CADDDR(args)));
-    break;
-  case 5:
-    first = CAR(args);
-    args = CDR(args);
-    probe = providerAddProbe(p->provider, name_str, 5,
-                             usdt_argtype_from_sexp(first),
-                             usdt_argtype_from_sexp(CAR(args)),
-                             usdt_argtype_from_sexp(CADR(args)),
-                             usdt_argtype_from_sexp(CADDR(args)),
-                             usdt_argtype_from_sexp(CADDDR(args)));
-    break;
-  case 6:
-    first = CAR(args);
-    args = CDR(args);
-    probe = providerAddProbe(p->provider, name_str, 6,
-                             usdt_argtype_from_sexp(first),
-                             usdt_argtype_from_sexp(CAR(args)),
-                             usdt_argtype_from_sexp(CADR(args)),
-                             usdt_argtype_from_sexp(CADDR(args)),
-                             usdt_argtype_from_sexp(CADDDR(args)),
-                             usdt_argtype_from_sexp(CAD4R(args)));
-    break;
-  default:
-    probe = providerAddProbe(p->provider, name_str, 0);
-    break;
-  }
+  /* providerAddProbe() only reads as many types as the probe accepts, so it is
+   * safe to always pass six. */
+  SDTProbe_t *probe = providerAddProbe(p->provider, name_str, arg_count,
+                                       types[0], types[1], types[2], types[3],
+                                       types[4], types[5]);
   if (!probe) {
     Rf_error("Failed to create USDT probe.\n");
   }
+  probe->stringArgs = string_args;
+  /* Probes added to a loaded provider get their own shard immediately. */
+  if (p->loaded && providerLoad(p->provider) < 0) {
+    Rf_error("Failed to load USDT probe: %s.\n", p->provider->error);
+  }
+  if (p->loaded) {
+    usdt_warn_memfd_fallback(p);
+  }
 
-  SEXP ptr = PROTECT(R_MakeExternalPtr(probe, R_NilValue, R_NilValue));
+  /* Keep the provider (which owns the probe) alive as long as the probe. */
+  SEXP ptr = PROTECT(R_MakeExternalPtr(probe, Rf_install("usdt_probe"),
+                                       provider));
   UNPROTECT(1);
   return ptr;
 }
 
-uint64_t usdt_arg_from_sexp(SEXP arg)
+SEXP R_usdt_probe_is_enabled(SEXP ptr)
+{
+  SDTProbe_t *probe = (SDTProbe_t *) R_ExternalPtrAddr(ptr);
+  if (!probe) {
+    Rf_error("Invalid USDT probe.\n");
+  }
+  return Rf_ScalarLogical(probeIsEnabled(probe));
+}
+
+/* For instrument(): unlike R_usdt_probe_is_enabled(), NULL rather than an
+ * error for a probe cleared by serialization, since instrumented functions can
+ * be copied to other processes (e.g. by parallel or saveRDS()). */
+static SDTProbe_t *usdt_function_probe(SEXP ptr)
+{
+  if (TYPEOF(ptr) != EXTPTRSXP) {
+    return NULL;
+  }
+  return (SDTProbe_t *) R_ExternalPtrAddr(ptr);
+}
+
+/* For instrument(): checks that an existing probe takes the arguments that
+ * R_usdt_fire_function_probe() passes. */
+SEXP R_usdt_check_function_probe(SEXP ptr, SEXP name)
+{
+  SDTProbe_t *probe = usdt_function_probe(ptr);
+  if (!probe || probe->argCount != 3 || probe->stringArgs != 1U ||
+      probe->argFmt[1] != int32 || probe->argFmt[2] != int64) {
+    Rf_error("Probe '%s' must take 'character', 'integer', and 'integer64' "
+             "arguments to be used by instrument().\n",
+             CHAR(Rf_asChar(name)));
+  }
+  return R_NilValue;
+}
+
+/* For instrument(): whether either of a function's probes is enabled, so that
+ * idle functions pay for a single check. Never an error. */
+SEXP R_usdt_function_probes_enabled(SEXP entry, SEXP exit)
+{
+  SDTProbe_t *entry_probe = usdt_function_probe(entry);
+  SDTProbe_t *exit_probe = usdt_function_probe(exit);
+  return Rf_ScalarLogical((entry_probe && probeIsEnabled(entry_probe)) ||
+                          (exit_probe && probeIsEnabled(exit_probe)));
+}
+
+/* For testing: simulates a tracer attaching to (or detaching from) a probe by
+ * adjusting its semaphore, just as bpftrace or perf would. */
+SEXP R_usdt_probe_simulate_tracer(SEXP ptr, SEXP attached)
+{
+  SDTProbe_t *probe = (SDTProbe_t *) R_ExternalPtrAddr(ptr);
+  if (!probe) {
+    Rf_error("Invalid USDT probe.\n");
+  }
+  if (!probe->_semaphore) {
+    Rf_error("The provider must be enabled to attach to its probes.\n");
+  }
+  if (Rf_asLogical(attached) == TRUE) {
+    (*probe->_semaphore)++;
+  } else if (*probe->_semaphore > 0) {
+    (*probe->_semaphore)--;
+  }
+  return R_NilValue;
+}
+
+/* Writes the probe arguments for the i-th element of arg into values without
+ * allocating, and returns the number of arguments used. Doubles (and int64s)
+ * are passed bit-for-bit; strings and raw vectors by reference, which is safe
+ * because the probe fires before control returns to R. */
+int usdt_args_from_elt(SEXP arg, R_xlen_t i, uint64_t *values)
 {
   switch(TYPEOF(arg)) {
   case LGLSXP:
-    return (uint64_t) LOGICAL(arg)[0];
+    values[0] = (uint64_t) LOGICAL(arg)[i];
+    return 1;
   case INTSXP:
-    return (uint64_t) INTEGER(arg)[0];
+    values[0] = (uint64_t) INTEGER(arg)[i];
+    return 1;
+  case REALSXP:
+    memcpy(&values[0], &REAL(arg)[i], sizeof(double));
+    return 1;
   case STRSXP:
-    return (uint64_t) CHAR(Rf_asChar(arg));
-  case REALSXP: {
-    /* Format reals as strings. */
-    SEXP str = PROTECT(Rf_coerceVector(arg, STRSXP));
-    UNPROTECT(1);
-    return (uint64_t) CHAR(Rf_asChar(str));
+    values[0] = (uint64_t) CHAR(STRING_ELT(arg, i));
+    return 1;
+  case RAWSXP:
+    /* A single buffer; there are no elements to index. */
+    values[0] = (uint64_t) RAW(arg);
+    values[1] = (uint64_t) XLENGTH(arg);
+    return 2;
+  case VECSXP: {
+    /* Lists of raw vectors hold one buffer per element (for batches). */
+    SEXP elt = VECTOR_ELT(arg, i);
+    if (TYPEOF(elt) != RAWSXP) {
+      Rf_error("Can't pass R '%s' objects to a probe.", Rf_type2char(TYPEOF(elt)));
+    }
+    return usdt_args_from_elt(elt, 0, values);
   }
   default:
     Rf_error("Can't pass R '%s' objects to a probe.", Rf_type2char(TYPEOF(arg)));
   }
 }
 
+static const char *usdt_argtype_name(SDTProbe_t *probe, int slot)
+{
+  if (probe->stringArgs & (1U << slot)) {
+    return "character";
+  }
+  switch(probe->argFmt[slot]) {
+  case int32:
+    return "integer";
+  case int64:
+    return "integer64";
+  case float64:
+    return "double";
+  default:
+    return "raw";
+  }
+}
+
+/* Checks that arg matches the type given to add_probe() for the argument in
+ * the given slot. This matters because the flight recorder dereferences
+ * string arguments. */
+static void usdt_check_argtype(SDTProbe_t *probe, SEXP arg, int slot)
+{
+  int is_string = (probe->stringArgs & (1U << slot)) != 0, ok;
+  if (slot >= probe->argCount) {
+    /* Caught by the argument count check. */
+    return;
+  }
+  switch(TYPEOF(arg)) {
+  case LGLSXP:
+    /* fallthrough */
+  case INTSXP:
+    ok = probe->argFmt[slot] == int32;
+    break;
+  case REALSXP:
+    ok = probe->argFmt[slot] == (usdt_is_integer64(arg) ? int64 : float64);
+    break;
+  case STRSXP:
+    ok = is_string;
+    break;
+  case RAWSXP:
+    /* fallthrough */
+  case VECSXP:
+    ok = !is_string && probe->argFmt[slot] == uint64 &&
+      slot + 1 < probe->argCount && probe->argFmt[slot + 1] == int64;
+    break;
+  default:
+    ok = 0;
+  }
+  if (!ok) {
+    Rf_error("Probe argument %d must be of type '%s', got '%s'.\n", slot + 1,
+             usdt_argtype_name(probe, slot), Rf_type2char(TYPEOF(arg)));
+  }
+}
+
+/* Checks that the probe parameters match the probe's types and add up to the
+ * number of arguments it accepts. */
+static void usdt_check_args(SDTProbe_t *probe, SEXP args)
+{
+  int arg_count = 0;
+  for (R_xlen_t j = 0; j < Rf_xlength(args); j++) {
+    SEXP arg = VECTOR_ELT(args, j);
+    usdt_check_argtype(probe, arg, arg_count);
+    /* Buffers are passed as a pointer and a length. */
+    arg_count += (TYPEOF(arg) == RAWSXP || TYPEOF(arg) == VECSXP) ? 2 : 1;
+  }
+  if (arg_count != probe->argCount) {
+    Rf_error("Invalid number of probe arguments. Expected %d, got %d.\n",
+             probe->argCount, arg_count);
+  }
+}
+
+/* Fills values from the i-th element of each of the probe parameters, which
+ * must already have passed usdt_check_args(). */
+static void usdt_args_from_list(SEXP args, R_xlen_t i, uint64_t *values)
+{
+  int arg_count = 0;
+  for (R_xlen_t j = 0; j < Rf_xlength(args); j++) {
+    arg_count += usdt_args_from_elt(VECTOR_ELT(args, j), i, &values[arg_count]);
+  }
+}
+
 SEXP R_usdt_fire_probe(SEXP ptr, SEXP fun, SEXP env)
 {
   SDTProbe_t *probe = (SDTProbe_t *) R_ExternalPtrAddr(ptr);
-  if (ptr == R_NilValue || !probe) {
-    Rf_error("Invalid USDT probe.\n");
-  }
-  if (!probeIsEnabled(probe)) {
+  if (!probe || !probeIsEnabled(probe)) {
     return Rf_ScalarLogical(FALSE);
   }
   SEXP fcall = PROTECT(Rf_lang1(fun));
@@ -211,61 +398,291 @@ SEXP R_usdt_fire_probe(SEXP ptr, SEXP fun, SEXP env)
     Rf_error("Expected the callback to return a list, got '%s'.",
              Rf_type2char(TYPEOF(args)));
   }
-  size_t arg_count = Rf_length(args);
-  if (arg_count != probe->argCount) {
-    Rf_error("Invalid number of probe arguments. Expected %d, got %d.\n",
-             probe->argCount, arg_count);
+
+  /* Only element 0 of each argument is read, so it must exist. Raw vectors
+   * are passed whole. */
+  for (R_xlen_t j = 0; j < Rf_xlength(args); j++) {
+    SEXP arg = VECTOR_ELT(args, j);
+    if (TYPEOF(arg) != RAWSXP && Rf_xlength(arg) != 1) {
+      Rf_error("Probe argument %d must have length 1, got %lld. "
+               "Use fire_batch() to fire more than one event.\n", (int) j + 1,
+               (long long) Rf_xlength(arg));
+    }
   }
 
-  switch (arg_count) {
-  case 1:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)));
-    break;
-  case 2:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 1)));
-    break;
-  case 3:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 1)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 2)));
-    break;
-  case 4:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 1)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 2)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 3)));
-    break;
-  case 5:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 1)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 2)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 3)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 4)));
-    break;
-  case 6:
-    probeFire(probe, usdt_arg_from_sexp(VECTOR_ELT(args, 0)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 1)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 2)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 3)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 4)),
-              usdt_arg_from_sexp(VECTOR_ELT(args, 5)));
-    break;
+  usdt_check_args(probe, args);
+  uint64_t values[MAX_ARGUMENTS + 1] = {0};
+  usdt_args_from_list(args, 0, values);
+  /* probeFire() only reads as many arguments as the probe accepts, so it is
+   * safe to always pass six. */
+  probeFire(probe, values[0], values[1], values[2], values[3], values[4],
+            values[5]);
+
+  UNPROTECT(2);
+  return Rf_ScalarLogical(TRUE);
+}
+
+SEXP R_usdt_fire_probe_batch(SEXP ptr, SEXP args)
+{
+  SDTProbe_t *probe = (SDTProbe_t *) R_ExternalPtrAddr(ptr);
+  if (!probe || !probeIsEnabled(probe)) {
+    return Rf_ScalarLogical(FALSE);
+  }
+  if (!Rf_isNewList(args)) {
+    Rf_error("Expected a list of probe arguments, got '%s'.",
+             Rf_type2char(TYPEOF(args)));
+  }
+
+  /* There would be no column to take the number of events from. */
+  if (probe->argCount == 0) {
+    Rf_error("Probes without arguments can't be fired in batches.\n");
+  }
+
+  /* Validate every column up front so that the loop below can't fail part of
+   * the way through. */
+  R_xlen_t n = Rf_xlength(args) > 0 ? Rf_xlength(VECTOR_ELT(args, 0)) : 0;
+  for (R_xlen_t j = 0; j < Rf_xlength(args); j++) {
+    SEXP col = VECTOR_ELT(args, j);
+    if (TYPEOF(col) == RAWSXP) {
+      Rf_error("Pass a list of raw vectors to fire a batch of buffers.\n");
+    }
+    if (Rf_xlength(col) != n) {
+      Rf_error("All probe arguments must have the same length.\n");
+    }
+    if (TYPEOF(col) == VECSXP) {
+      for (R_xlen_t i = 0; i < n; i++) {
+        SEXP elt = VECTOR_ELT(col, i);
+        if (TYPEOF(elt) != RAWSXP) {
+          Rf_error("Element %lld of probe argument %d must be a raw vector, "
+                   "got '%s'.\n", (long long) i + 1, (int) j + 1,
+                   Rf_type2char(TYPEOF(elt)));
+        }
+      }
+    }
+  }
+  usdt_check_args(probe, args);
+
+  uint64_t values[MAX_ARGUMENTS + 1] = {0};
+  for (R_xlen_t i = 0; i < n; i++) {
+    usdt_args_from_list(args, i, values);
+    probeFire(probe, values[0], values[1], values[2], values[3], values[4],
+              values[5]);
+  }
+
+  return Rf_ScalarLogical(TRUE);
+}
+
+SEXP R_usdt_provider_start_recorder(SEXP ptr, SEXP capacity)
+{
+  struct provider *p = (struct provider *) R_ExternalPtrAddr(ptr);
+  if (!p) {
+    Rf_error("Invalid USDT provider.\n");
+  }
+  double n = Rf_asReal(capacity);
+  if (ISNAN(n) || n < 1 || n > SDT_RECORDER_MAX_CAPACITY) {
+    Rf_error("The recorder's capacity must be between 1 and %lu.\n",
+             SDT_RECORDER_MAX_CAPACITY);
+  }
+  if (providerStartRecorder(p->provider, (unsigned long) n) < 0) {
+    Rf_error("Failed to start flight recorder: %s.\n", p->provider->error);
+  }
+  return R_NilValue;
+}
+
+SEXP R_usdt_provider_stop_recorder(SEXP ptr)
+{
+  struct provider *p = (struct provider *) R_ExternalPtrAddr(ptr);
+  if (!p) {
+    Rf_error("Invalid USDT provider.\n");
+  }
+  providerStopRecorder(p->provider);
+  return R_NilValue;
+}
+
+static SEXP usdt_recorder_arg(SDTRecorder_t *recorder, SDTRecord_t *record,
+                              int i)
+{
+  uint64_t value = record->args[i];
+  char str[SDT_RECORDER_STRING_SIZE];
+  double real;
+  if (record->stringArgs & (1U << i)) {
+    /* Evicted strings become NA. */
+    if (!recorderString(recorder, value, str)) {
+      return Rf_ScalarString(NA_STRING);
+    }
+    return Rf_ScalarString(Rf_mkChar(str));
+  }
+  switch(record->argFmt[i]) {
+  case int32:
+    return Rf_ScalarInteger((int32_t) value);
+  case float64:
+    memcpy(&real, &value, sizeof(double));
+    return Rf_ScalarReal(real);
+  case int64:
+    return Rf_ScalarReal((double) (int64_t) value);
   default:
-    probeFire(probe);
-    break;
+    return Rf_ScalarReal((double) value);
   }
+}
 
-  UNPROTECT(2);
+/* Copies the records still in the ring buffer, oldest first, into a list of
+ * timestamps, probe names, and argument lists. */
+static SEXP usdt_recorder_to_list(SDTRecorder_t *recorder)
+{
+  uint64_t head = atomic_load(&recorder->header->head);
+  uint64_t start = head > recorder->header->capacity ?
+    head - recorder->header->capacity : 0;
+  R_xlen_t n = (R_xlen_t) (head - start), k = 0;
+  SEXP timestamp = PROTECT(Rf_allocVector(REALSXP, n));
+  SEXP probe = PROTECT(Rf_allocVector(STRSXP, n));
+  SEXP args = PROTECT(Rf_allocVector(VECSXP, n));
+  SDTRecord_t record;
+  char name[SDT_RECORDER_STRING_SIZE];
+
+  for (uint64_t i = start; i < head; i++) {
+    /* Skip records overwritten (or being written) while we read. */
+    if (!recorderRead(recorder, i, &record)) {
+      continue;
+    }
+    REAL(timestamp)[k] = (double) record.timestamp;
+    SET_STRING_ELT(probe, k, recorderString(recorder, record.probe, name) ?
+                   Rf_mkChar(name) : NA_STRING);
+    SEXP values = Rf_allocVector(VECSXP, record.argCount);
+    SET_VECTOR_ELT(args, k, values);
+    for (int j = 0; j < record.argCount && j < MAX_ARGUMENTS; j++) {
+      SET_VECTOR_ELT(values, j, usdt_recorder_arg(recorder, &record, j));
+    }
+    k++;
+  }
+
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, 3));
+  SET_VECTOR_ELT(out, 0, Rf_xlengthgets(timestamp, k));
+  SET_VECTOR_ELT(out, 1, Rf_xlengthgets(probe, k));
+  SET_VECTOR_ELT(out, 2, Rf_xlengthgets(args, k));
+  UNPROTECT(4);
+  return out;
+}
+
+SEXP R_usdt_provider_read_recorder(SEXP ptr)
+{
+  struct provider *p = (struct provider *) R_ExternalPtrAddr(ptr);
+  if (!p) {
+    Rf_error("Invalid USDT provider.\n");
+  }
+  if (!p->provider->_recorder) {
+    Rf_error("The flight recorder is not running.\n");
+  }
+  return usdt_recorder_to_list(p->provider->_recorder);
+}
+
+SEXP R_usdt_read_recorder(SEXP path)
+{
+  const char *path_str = CHAR(Rf_asChar(path));
+  SDTRecorder_t *recorder = recorderOpen(path_str);
+  if (!recorder) {
+    Rf_error("Failed to open flight recorder '%s'.\n", path_str);
+  }
+  SEXP out = usdt_recorder_to_list(recorder);
+  /* Only unmaps the segment: it belongs to the process that created it. */
+  recorderClose(recorder);
+  return out;
+}
+
+/* For instrument(): fires a function-entry or function-return probe with the
+ * function's name, the call depth, and a CLOCK_MONOTONIC timestamp in
+ * nanoseconds, without allocating. */
+SEXP R_usdt_fire_function_probe(SEXP ptr, SEXP name, SEXP depth)
+{
+  SDTProbe_t *probe = usdt_function_probe(ptr);
+  struct timespec now;
+  if (!probe || !probeIsEnabled(probe)) {
+    return Rf_ScalarLogical(FALSE);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t timestamp = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+  probeFire(probe, (uint64_t) CHAR(STRING_ELT(name, 0)),
+            (uint64_t) Rf_asInteger(depth), timestamp, 0, 0, 0);
   return Rf_ScalarLogical(TRUE);
 }
 
+/* The C API for other packages, registered with R_RegisterCCallable(). See
+ * inst/include/usdt.h. */
+
+/* USDT_PROBE_ENABLED() reads these fields through usdt_probe_t. */
+_Static_assert(offsetof(SDTProbe_t, _semaphore) ==
+               offsetof(usdt_probe_t, semaphore),
+               "usdt_probe_t.semaphore must alias SDTProbe_t._semaphore");
+_Static_assert(offsetof(SDTProbe_t, _recorder) ==
+               offsetof(usdt_probe_t, recorder),
+               "usdt_probe_t.recorder must alias SDTProbe_t._recorder");
+
+/* Only accepts the pointer from a handle's ptr() method. */
+static SDTProbe_t *usdt_c_probe(SEXP ptr)
+{
+  if (TYPEOF(ptr) != EXTPTRSXP ||
+      R_ExternalPtrTag(ptr) != Rf_install("usdt_probe")) {
+    Rf_error("Expected the pointer from a USDT probe handle's ptr() method.\n");
+  }
+  SDTProbe_t *probe = (SDTProbe_t *) R_ExternalPtrAddr(ptr);
+  if (!probe) {
+    Rf_error("Invalid USDT probe.\n");
+  }
+  return probe;
+}
+
+static int usdt_c_probe_enabled(SDTProbe_t *probe)
+{
+  return probe != NULL && probeIsEnabled(probe);
+}
+
+/* Does not touch the R API, so it can be called from any thread. */
+static void usdt_c_probe_fire(SDTProbe_t *probe, const uint64_t *args)
+{
+  uint64_t values[MAX_ARGUMENTS] = {0};
+  if (probe == NULL) {
+    return;
+  }
+  memcpy(values, args, probe->argCount * sizeof(uint64_t));
+  probeFire(probe, values[0], values[1], values[2], values[3], values[4],
+            values[5]);
+}
+
+/* For testing: fires a probe through inst/include/usdt.h, just as another
+ * package would. */
+SEXP R_usdt_probe_c_api_fire(SEXP ptr, SEXP args)
+{
+  usdt_probe_t *probe = usdt_probe(ptr);
+  int enabled = USDT_PROBE_ENABLED(probe);
+  if (enabled != usdt_probe_enabled(probe)) {
+    Rf_error("USDT_PROBE_ENABLED() disagrees with usdt_probe_enabled().\n");
+  }
+  if (enabled) {
+    uint64_t values[MAX_ARGUMENTS + 1] = {0};
+    usdt_check_args((SDTProbe_t *) probe, args);
+    usdt_args_from_list(args, 0, values);
+    usdt_probe_fire(probe, values);
+  }
+  return Rf_ScalarLogical(enabled);
+}
+
 static const R_CallMethodDef usdt_entries[] = {
-  {"R_usdt_provider", (DL_FUNC) &R_usdt_provider, 1},
+  {"R_usdt_provider", (DL_FUNC) &R_usdt_provider, 3},
   {"R_usdt_provider_is_enabled", (DL_FUNC) &R_usdt_provider_is_enabled, 1},
   {"R_usdt_provider_enable", (DL_FUNC) &R_usdt_provider_enable, 1},
   {"R_usdt_provider_disable", (DL_FUNC) &R_usdt_provider_disable, 1},
+  {"R_usdt_provider_paths", (DL_FUNC) &R_usdt_provider_paths, 1},
+  {"R_usdt_probe_is_enabled", (DL_FUNC) &R_usdt_probe_is_enabled, 1},
+  {"R_usdt_function_probes_enabled", (DL_FUNC) &R_usdt_function_probes_enabled, 2},
+  {"R_usdt_check_function_probe", (DL_FUNC) &R_usdt_check_function_probe, 2},
+  {"R_usdt_probe_simulate_tracer", (DL_FUNC) &R_usdt_probe_simulate_tracer, 2},
+  {"R_usdt_probe_c_api_fire", (DL_FUNC) &R_usdt_probe_c_api_fire, 2},
   {"R_usdt_fire_probe", (DL_FUNC) &R_usdt_fire_probe, 3},
+  {"R_usdt_fire_probe_batch", (DL_FUNC) &R_usdt_fire_probe_batch, 2},
+  {"R_usdt_fire_function_probe", (DL_FUNC) &R_usdt_fire_function_probe, 3},
+  {"R_usdt_provider_start_recorder", (DL_FUNC) &R_usdt_provider_start_recorder, 2},
+  {"R_usdt_provider_stop_recorder", (DL_FUNC) &R_usdt_provider_stop_recorder, 1},
+  {"R_usdt_provider_read_recorder", (DL_FUNC) &R_usdt_provider_read_recorder, 1},
+  {"R_usdt_read_recorder", (DL_FUNC) &R_usdt_read_recorder, 1},
   {NULL, NULL, 0}
 };
 
@@ -277,4 +694,8 @@ static const R_ExternalMethodDef usdt_entries_ext[] = {
 void R_init_usdt(DllInfo *info) {
   R_registerRoutines(info, NULL, usdt_entries, NULL, usdt_entries_ext);
   R_useDynamicSymbols(info, FALSE);
+
+  R_RegisterCCallable("usdt", "probe", (DL_FUNC) &usdt_c_probe);
+  R_RegisterCCallable("usdt", "probe_enabled", (DL_FUNC) &usdt_c_probe_enabled);
+  R_RegisterCCallable("usdt", "probe_fire", (DL_FUNC) &usdt_c_probe_fire);
 }